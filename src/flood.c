@@ -22,7 +22,12 @@
 static const char *seeds[] = { "69.164.196.239" };
 
 struct node {
-    const char *ip;
+    char ip[INET_ADDRSTRLEN];
+    double rtt;
+    double cost;
+    double fails;
+    long seen;
+    long tried;
     struct node *next;
 };
 
@@ -35,6 +40,118 @@ struct params {
     char *tr[MAXTR];
 };
 
+struct range {
+    char start[HASHLEN];
+    char end[HASHLEN];
+    char cursor[HASHLEN];
+};
+
+struct packet {
+    unsigned int seq;
+    int len;
+    int state;
+    int retries;
+    double sent;
+    char buf[BUFLEN];
+};
+
+struct pull {
+    struct sockaddr_in addr;
+    struct range range;
+    struct packet *window;
+    unsigned int id;
+    unsigned int next;
+    int active;
+    int done;
+    int queued;
+    int resumes;
+    time_t last;
+    double started;
+    leveldb_iterator_t *iter;
+    leveldb_writebatch_t *batch;
+    int batched;
+    int ordered;
+    unsigned long written;
+    unsigned long unchanged;
+};
+
+/* the sending side of a stream, with its window and congestion state */
+struct stream {
+    struct sockaddr_in addr;
+    struct range range;
+    unsigned int id;
+    struct packet *window;
+    unsigned int base;
+    unsigned int next;
+    unsigned int acked;
+    int done;
+    int finished;
+    int status;
+    long retransmits;
+    double start;
+    double progress;
+    double lastcut;
+    double nextsend;
+    double cwnd;
+    double ssthresh;
+    double srtt;
+    double rttvar;
+    double rto;
+    leveldb_iterator_t *iter;
+};
+
+struct request {
+    struct sockaddr_in addr;
+    int len;
+    char buf[BUFLEN + 1];
+};
+
+/* datagrams held back while a stream is being sent */
+struct queue {
+    struct request reqs[MAXQUEUE];
+    int head;
+    int count;
+};
+
+/* packet states in a send or receive window */
+enum { FREE, QUEUED, ACKED };
+
+struct entry {
+    char hash[HASHLEN];
+    char *link;
+    long last;
+    int ref;
+    int next;
+};
+
+/* hot links, evicted by the CLOCK algorithm: the hand clears reference
+   bits as it sweeps and evicts the first entry not used since its last
+   pass; a hash table of entry indices chained through next finds them */
+struct cache {
+    struct entry *entries;
+    int *buckets;
+    int size;
+    int count;
+    int hand;
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+static struct cache cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* held from reading a stored record to writing it back, so that the
+   purge thread and incoming links do not overwrite each other */
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* up to MAXPEERS peers heard from, persisted in PEERS */
+static struct node *peers;
+static int npeers;
+static int peers_loaded;
+static int peers_dirty;
+
 void die(const char *message)
 {
     if (errno) {
@@ -136,13 +253,580 @@ char *_substr(const char *string, int pos, int len)
     return substring;
 }
 
-int parselink(leveldb_t *db, char buf[BUFLEN - 1], const char* caller)
+/* compare a database key to a range bound; keys are stored with their
+   trailing NUL, so only the string part takes part in the comparison */
+int keycmp(const char *key, size_t keylen, const char *bound)
+{
+    size_t boundlen = strlen(bound);
+    int rc;
+
+    keylen = strnlen(key, keylen);
+    rc = memcmp(key, bound, (keylen < boundlen) ? keylen : boundlen);
+    if (rc) return rc;
+    return (keylen > boundlen) - (keylen < boundlen);
+}
+
+/* parse "r [start] [end] [cursor] [id]", where "-" marks an open bound:
+   the range covers start <= key < end, resuming after the cursor key, and
+   is streamed back with the requester's stream id */
+int parserange(const char *buf, struct range *range, unsigned int *id)
+{
+    char start[HASHLEN], end[HASHLEN], cursor[HASHLEN];
+    int n;
+
+    bzero(range, sizeof *range);
+    *id = 0;
+    if (buf[0] != 'r' || (buf[1] != '\0' && buf[1] != ' ')) return 1;
+
+    n = sscanf(buf + 1, "%40s %40s %40s %u", start, end, cursor, id);
+    if (n >= 1 && strcmp(start, "-")) strlcpy(range->start, start, HASHLEN);
+    if (n >= 2 && strcmp(end, "-")) strlcpy(range->end, end, HASHLEN);
+    if (n >= 3 && strcmp(cursor, "-")) strlcpy(range->cursor, cursor, HASHLEN);
+
+    return 0;
+}
+
+/* parse a stream packet header: "d <id> <seq> <last seen> <link>" carries a link,
+   "c <id> <seq>" closes the stream and "a <id> <seq> <next>" acknowledges;
+   "q <id> <ahead>" tells that a request is queued behind ahead others */
+int parsepacket(const char *buf, char *type, unsigned int *id,
+                unsigned int *seq, const char **payload)
+{
+    int n = 0;
+
+    if (buf[0] != 'd' && buf[0] != 'c' && buf[0] != 'a' && buf[0] != 'q') return 1;
+    if (sscanf(buf + 1, " %u %u%n", id, seq, &n) != 2) return 1;
+
+    *type = buf[0];
+    *payload = buf + 1 + n;
+    if (**payload == ' ') (*payload)++;
+
+    return 0;
+}
+
+double timenow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* acknowledge packet seq of a stream, along with every packet before
+   next, so that a lost ack does not cost the sender a retransmission */
+void sendack(int sockfd, struct sockaddr_in *addr, unsigned int id,
+             unsigned int seq, unsigned int next)
+{
+    char buf[48];
+    int rc;
+
+    snprintf(buf, sizeof buf, "a %u %u %u", id, seq, next);
+    rc = sendto(sockfd, buf, strlen(buf) + 1, 0, (struct sockaddr *)addr,
+                sizeof *addr);
+    if (rc == -1 && errno != ENOBUFS && errno != EAGAIN)
+        die("[sendack] Failed to send ack");
+}
+
+/* position an iterator on the first key of a range not yet received */
+void seekrange(leveldb_iterator_t *iter, const struct range *range)
+{
+    const char *key;
+    size_t keylen;
+
+    if (range->cursor[0] && strcmp(range->cursor, range->start) >= 0) {
+        leveldb_iter_seek(iter, range->cursor, strlen(range->cursor));
+        while (leveldb_iter_valid(iter))
+        {
+            key = leveldb_iter_key(iter, &keylen);
+            if (keycmp(key, keylen, range->cursor) > 0) break;
+            leveldb_iter_next(iter);
+        }
+    } else if (range->start[0]) {
+        leveldb_iter_seek(iter, range->start, strlen(range->start));
+    } else {
+        leveldb_iter_seek_to_first(iter);
+    }
+}
+
+/* copy the infohash of a magnet link into hash, 0 on success */
+int linkhash(const char *buf, char hash[HASHLEN])
+{
+    const char *walk;
+
+    if ( !(walk = strstr(buf, "btih:"))) return 1;
+    if (strnlen(walk + 5, HASHLEN - 1) < HASHLEN - 1) return 1;
+    strlcpy(hash, walk + 5, HASHLEN);
+
+    return 0;
+}
+
+/* length of the link at the head of a stored record, which may lack its
+   NUL when the record was written by xmlparse */
+size_t linklen(const char *record, size_t len)
+{
+    return strnlen(record, (len < BUFLEN - 1) ? len : BUFLEN - 1);
+}
+
+/* a stored record is the link, a NUL, then "<first seen> <last seen>" in
+   seconds since the epoch; returns the record length */
+size_t packrecord(char record[RECLEN], const char *link, size_t len,
+                  long first, long last)
+{
+    memcpy(record, link, len);
+    record[len] = '\0';
+
+    return len + 1 + snprintf(record + len + 1, RECLEN - len - 1, "%ld %ld",
+                              first, last) + 1;
+}
+
+/* read the first and last seen times of a record, 0 if it has them */
+int unpackrecord(const char *record, size_t len, long *first, long *last)
+{
+    char stamp[64];
+    size_t n;
+
+    *first = *last = 0;
+    n = linklen(record, len) + 1;
+    if (n >= len || len - n >= sizeof stamp) return 1;
+    memcpy(stamp, record + n, len - n);
+    stamp[len - n] = '\0';
+
+    return sscanf(stamp, "%ld %ld", first, last) != 2;
+}
+
+int expired(long last, time_t now)
+{
+    return TTL && last && now - last > TTL;
+}
+
+/* build the record to store for a link last seen at time seen (0 for
+   now) by its sender, given the stored record for its hash, if any.
+   Returns the record length, or 0 when the stored record is up to date:
+   the link is unchanged and its last seen time recent enough not to need
+   refreshing, or the link has already expired and is not revived. */
+size_t mergerecord(char record[RECLEN], const char *link, long seen,
+                   const char *stored, size_t storedlen)
+{
+    long first = 0, last = 0;
+    size_t len = strlen(link);
+    time_t now = time(NULL);
+
+    if (seen <= 0 || seen > now) seen = now;
+    if (expired(seen, now)) {
+        debug(" - Skip: link expired\n");
+        return 0;
+    }
+
+    if (stored != NULL) {
+        unpackrecord(stored, storedlen, &first, &last);
+        if (seen < last) seen = last;
+        if (linklen(stored, storedlen) == len && !strncmp(link, stored, len) &&
+            (!TTL || seen - last < TOUCH_INTERVAL)) {
+            debug(" - Skip: link already in database\n");
+            return 0;
+        }
+    }
+    if (!first) first = seen;
+
+    return packrecord(record, link, len, first, seen);
+}
+
+void cache_init(int size)
+{
+    int i;
+
+    cache.entries = calloc(size, sizeof(struct entry));
+    cache.buckets = malloc(size * sizeof(int));
+    if (cache.entries == NULL || cache.buckets == NULL)
+        die("[cache_init] Cannot allocate cache");
+    for (i = 0; i < size; i++) cache.buckets[i] = -1;
+
+    cache.size = size;
+    cache.count = 0;
+    cache.hand = 0;
+    cache.bytes = 0;
+    cache.hits = cache.misses = cache.evictions = 0;
+}
+
+/* FNV-1a over the infohash string */
+int cache_bucket(const char *hash)
+{
+    unsigned int h = 2166136261u;
+
+    while (*hash) {
+        h ^= (unsigned char)*hash++;
+        h *= 16777619u;
+    }
+
+    return (int)(h % (unsigned int)cache.size);
+}
+
+/* return the index of the entry for hash, or -1 */
+int cache_find(const char *hash)
+{
+    int i;
+
+    if (cache.size == 0) return -1;
+    for (i = cache.buckets[cache_bucket(hash)]; i != -1; i = cache.entries[i].next)
+    {
+        if (!strcmp(cache.entries[i].hash, hash)) return i;
+    }
+
+    return -1;
+}
+
+void cache_remove(const char *hash)
+{
+    int i, *prev;
+    struct entry *e;
+
+    prev = &cache.buckets[cache_bucket(hash)];
+    for (i = *prev; i != -1; prev = &e->next, i = *prev)
+    {
+        e = &cache.entries[i];
+        if (strcmp(e->hash, hash)) continue;
+
+        *prev = e->next;
+        cache.bytes -= strlen(e->link) + 1;
+        cache.count--;
+        free(e->link);
+        e->link = NULL;
+        e->ref = 0;
+        return;
+    }
+}
+
+void cache_del(const char *hash)
+{
+    if (cache.size == 0) return;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_remove(hash);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* copy the cached link for hash into buf, 0 on a hit */
+int cache_get(const char *hash, char buf[BUFLEN])
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    if ( (i = cache_find(hash)) == -1 ||
+         expired(cache.entries[i].last, time(NULL))) {
+        if (i != -1) cache_remove(hash);
+        cache.misses++;
+        pthread_mutex_unlock(&cache_lock);
+        return 1;
+    }
+    cache.hits++;
+    cache.entries[i].ref = 1;
+    strlcpy(buf, cache.entries[i].link, BUFLEN);
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+void cache_put(const char *hash, const char *link, long last)
+{
+    int b;
+    struct entry *e;
+
+    if (cache.size == 0 || expired(last, time(NULL))) return;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_find(hash) != -1) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    /* sweep the hand to a free slot, or to an entry that is not referenced */
+    loop
+    {
+        e = &cache.entries[cache.hand];
+        cache.hand = (cache.hand + 1) % cache.size;
+        if (e->link == NULL) break;
+        if (e->ref) {
+            e->ref = 0;
+            continue;
+        }
+        cache_remove(e->hash);
+        cache.evictions++;
+        break;
+    }
+
+    if ( (e->link = strdup(link)) == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    strlcpy(e->hash, hash, HASHLEN);
+    e->last = last;
+    e->ref = 0;
+    b = cache_bucket(hash);
+    e->next = cache.buckets[b];
+    cache.buckets[b] = e - cache.entries;
+    cache.bytes += strlen(link) + 1;
+    cache.count++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* weight left to a measurement taken at time then */
+double peer_weight(long then, time_t now)
+{
+    if (then <= 0 || now <= then) return 1;
+    return pow(0.5, (double)(now - then) / PEER_HALFLIFE);
+}
+
+/* links per second we expect from a peer, discounted by recent failures.
+   A peer not pulled from yet is assumed to cost PEER_COST seconds per
+   link, or a round trip per link if it is further away than that. */
+double peer_score(const struct node *peer, time_t now)
+{
+    double cost;
+
+    if (peer->cost > 0)
+        cost = peer->cost;
+    else
+        cost = (peer->rtt > PEER_COST) ? peer->rtt : PEER_COST;
+
+    return 1 / (cost * (1 + peer->fails * peer_weight(peer->tried, now)));
+}
+
+/* the last time we heard from a peer or tried to sync with it */
+long peer_last(const struct node *peer)
+{
+    return (peer->seen > peer->tried) ? peer->seen : peer->tried;
+}
+
+/* make room for a new peer by dropping the one unheard of the longest
+   among those never synced with, as one-off and spoofed sources are, or
+   failing that the worst scoring one */
+void peer_evict(time_t now)
+{
+    struct node *peer, **link, **victim = NULL;
+
+    for (link = &peers; (peer = *link) != NULL; link = &peer->next)
+    {
+        if (victim == NULL || (!peer->tried && (*victim)->tried)) {
+            victim = link;
+        } else if (!peer->tried == !(*victim)->tried) {
+            if (peer->tried ? peer_score(peer, now) < peer_score(*victim, now)
+                            : peer_last(peer) < peer_last(*victim))
+                victim = link;
+        }
+    }
+    if (victim == NULL) return;
+
+    peer = *victim;
+    *victim = peer->next;
+    free(peer);
+    npeers--;
+    peers_dirty = 1;
+}
+
+/* forget peers neither heard from nor tried for PEER_EXPIRE seconds */
+void peers_age(time_t now)
+{
+    struct node *peer, **link = &peers;
+
+    while ( (peer = *link) != NULL)
+    {
+        if (now - peer_last(peer) <= PEER_EXPIRE) {
+            link = &peer->next;
+            continue;
+        }
+        *link = peer->next;
+        free(peer);
+        npeers--;
+        peers_dirty = 1;
+    }
+}
+
+struct node *peer_find(const char *ip, int create)
+{
+    struct node *peer, **link;
+
+    for (link = &peers; (peer = *link) != NULL; link = &peer->next)
+    {
+        if (strcmp(peer->ip, ip)) continue;
+
+        /* keep busy peers at the front, where they are found first */
+        *link = peer->next;
+        peer->next = peers;
+        peers = peer;
+        return peer;
+    }
+    if (!create) return NULL;
+
+    if (npeers >= MAXPEERS) peer_evict(time(NULL));
+    if ( (peer = calloc(1, sizeof(struct node))) == NULL) return NULL;
+    strlcpy(peer->ip, ip, INET_ADDRSTRLEN);
+    peer->next = peers;
+    peers = peer;
+    npeers++;
+    peers_dirty = 1;
+
+    return peer;
+}
+
+/* each line of PEERS is "<ip> <rtt> <cost> <fails> <seen> <tried>" */
+void peers_load(void)
+{
+    FILE *fp;
+    char ip[INET_ADDRSTRLEN];
+    double rtt, cost, fails;
+    long seen, tried;
+    time_t now = time(NULL);
+    struct node *peer;
+
+    if (peers_loaded) return;
+    peers_loaded = 1;
+
+    if ( (fp = fopen(PEERS, "r")) == NULL) return;
+    while (fscanf(fp, "%15s %lf %lf %lf %ld %ld", ip, &rtt, &cost, &fails,
+                  &seen, &tried) == 6)
+    {
+        /* a peer that has only ever failed was tried but never seen */
+        if (now - ((seen > tried) ? seen : tried) > PEER_EXPIRE) continue;
+        if ( (peer = peer_find(ip, 1)) == NULL) break;
+        peer->rtt = rtt;
+        peer->cost = cost;
+        peer->fails = fails;
+        peer->seen = seen;
+        peer->tried = tried;
+    }
+    fclose(fp);
+    peers_dirty = 0;
+}
+
+void peers_save(void)
+{
+    FILE *fp;
+    struct node *peer;
+
+    if (!peers_dirty) return;
+
+    /* write a new table, then swap it in */
+    if ( (fp = fopen(PEERS ".tmp", "w")) == NULL) {
+        debug("[peers_save] Cannot write peer table\n");
+        return;
+    }
+    for (peer = peers; peer != NULL; peer = peer->next)
+    {
+        fprintf(fp, "%s %.6f %.6f %.3f %ld %ld\n", peer->ip, peer->rtt,
+                peer->cost, peer->fails, peer->seen, peer->tried);
+    }
+    if (fclose(fp) || rename(PEERS ".tmp", PEERS)) {
+        debug("[peers_save] Cannot write peer table\n");
+        return;
+    }
+    peers_dirty = 0;
+}
+
+void peer_seen(const char *ip)
+{
+    struct node *peer;
+
+    if ( (peer = peer_find(ip, 1)) == NULL) return;
+    peer->seen = time(NULL);
+    peers_dirty = 1;
+}
+
+/* fold the round trip time of a stream we served into a peer's record;
+   how well a sync went counts only for syncs we started */
+void peer_rtt(const char *ip, double rtt)
+{
+    struct node *peer;
+    time_t now = time(NULL);
+    double alpha;
+
+    if (rtt <= 0 || (peer = peer_find(ip, 1)) == NULL) return;
+
+    alpha = 1 - peer_weight(peer->seen, now);
+    if (alpha < 0.25) alpha = 0.25;
+    peer->rtt = (peer->rtt > 0) ? (1 - alpha) * peer->rtt + alpha * rtt : rtt;
+    peer->seen = now;
+    peers_dirty = 1;
+}
+
+/* fold a sync with a peer into its record: a round trip time and a cost
+   in seconds per link when measured (0 otherwise), or a failure.  Older
+   measurements weigh less the longer ago they were made. */
+void peer_measure(const char *ip, double rtt, double cost, int failed)
+{
+    struct node *peer;
+    time_t now = time(NULL);
+    double alpha;
+
+    if ( (peer = peer_find(ip, 1)) == NULL) return;
+
+    alpha = 1 - peer_weight(peer->tried, now);
+    if (alpha < 0.25) alpha = 0.25;
+    if (rtt > 0) peer->rtt = (peer->rtt > 0) ? (1 - alpha) * peer->rtt + alpha * rtt : rtt;
+    if (cost > 0) peer->cost = (peer->cost > 0) ? (1 - alpha) * peer->cost + alpha * cost : cost;
+    peer->fails = peer->fails * peer_weight(peer->tried, now) + (failed ? 1 : 0);
+    peer->tried = now;
+    if (!failed) peer->seen = now;
+    peers_dirty = 1;
+}
+
+int peer_cmp(const void *a, const void *b)
+{
+    time_t now = time(NULL);
+    double sa = peer_score(*(struct node * const *)a, now);
+    double sb = peer_score(*(struct node * const *)b, now);
+
+    return (sa < sb) - (sa > sb);
+}
+
+/* choose up to max peers other than self to sync with: the best scoring
+   ones, plus one slot for a peer never synced with, or a random one, so
+   that untested peers get measured and the scores do not go stale */
+int peers_pick(const char **ips, int max, const char *self)
+{
+    struct node **ranked, *peer;
+    int i, n = 0, num_ips = 0, explore = -1;
+
+    for (peer = peers; peer != NULL; peer = peer->next) n++;
+    if (n == 0 || max == 0) return 0;
+    if ( (ranked = malloc(n * sizeof(struct node *))) == NULL) return 0;
+
+    n = 0;
+    for (peer = peers; peer != NULL; peer = peer->next)
+    {
+        if (self == NULL || strcmp(peer->ip, self)) ranked[n++] = peer;
+    }
+    qsort(ranked, n, sizeof(struct node *), peer_cmp);
+
+    if (n > max) {
+        for (i = max - 1; i < n && explore == -1; i++)
+        {
+            if (!ranked[i]->tried) explore = i;
+        }
+        if (explore == -1) explore = max - 1 + rand() % (n - max + 1);
+    }
+
+    for (i = 0; i < n && num_ips < max; i++)
+    {
+        if (explore != -1 && num_ips == max - 1) i = explore;
+        ips[num_ips++] = ranked[i]->ip;
+        debug("Peer: %s [score %.2f, rtt %.1fms, %.2fms/link, %.1f fails]\n",
+              ranked[i]->ip, peer_score(ranked[i], time(NULL)),
+              ranked[i]->rtt * 1000, ranked[i]->cost * 1000, ranked[i]->fails);
+    }
+    free(ranked);
+
+    return num_ips;
+}
+
+/* store a magnet link last seen at time seen (0 for now) by its sender */
+int parselink(leveldb_t *db, char buf[BUFLEN - 1], long seen, const char* caller)
 {
     int sockfd, rc, remain, reuse, len;
     char *external_ip, *local_ip, *walk, *next, *read, *bufptr, *err = NULL;
     char *xl, *dl;
     const char *hash, *link;
-    size_t readlen;
+    char record[RECLEN];
+    size_t readlen, reclen;
     size_t hashlen = HASHLEN;
     struct params magnet;
     struct sockaddr_in servaddr, cliaddr;
@@ -194,62 +878,706 @@ int parselink(leveldb_t *db, char buf[BUFLEN - 1], const char* caller)
         leveldb_free(err);
         debug("[%s] Failed to open database\n", caller);
     }
+    pthread_mutex_lock(&store_lock);
     read = leveldb_get(db, roptions, magnet.hash, HASHLEN, &readlen, &err);
     if (err != NULL) {
         leveldb_free(err);
+        err = NULL;
         debug("[%s] Database read failed\n", caller);
     }
 
-    /* write the hash to the database, unless the hash is already in the
-       database, and the stored link is identical to the new link */
-    if (read && !strncmp(buf, read, BUFLEN)) {
-        debug(" - Skip: link already in database\n");
-    } else {
+    /* write the hash to the database, unless the stored record is
+       already up to date */
+    reclen = mergerecord(record, buf, seen, read, readlen);
+    if (read != NULL) leveldb_free(read);
+    if (reclen) {
         debug(" - Save link to database\n");
-        leveldb_put(db, woptions, magnet.hash, HASHLEN, buf, BUFLEN, &err);
+        cache_del(magnet.hash);
+        leveldb_put(db, woptions, magnet.hash, HASHLEN, record, reclen, &err);
         if (err != NULL) {
             leveldb_free(err);
             debug("[%s] Database write failed\n", caller);
         }
     }
+    pthread_mutex_unlock(&store_lock);
+
+    leveldb_readoptions_destroy(roptions);
+    leveldb_writeoptions_destroy(woptions);
 
     return 0;
 }
 
-void runserver(void)
+/* copy the link for hash into buf from the cache, falling back to the
+   database and caching what it returns; 0 if the link was found */
+int lookup(leveldb_t *db, const char *hash, char buf[BUFLEN])
 {
-    debug("Start server...\n");
-    const char *_fn = "runserver";
-
-    int sockfd, rc, remain, reuse, len;
-    char buf[BUFLEN + 1];
-    char *external_ip, *local_ip, *walk, *next, *read, *bufptr, *err = NULL;
-    char *xl, *dl;
-    const char *hash, *link;
+    char *read, *err = NULL;
     size_t readlen;
-    size_t hashlen = HASHLEN;
-    struct params magnet;
-    struct sockaddr_in servaddr, cliaddr;
-    socklen_t slen = sizeof servaddr;
-    leveldb_t *db;
-    leveldb_options_t *options;
+    long first, last;
     leveldb_readoptions_t *roptions;
-    leveldb_writeoptions_t *woptions;
-
-    /* zero and set server socket struct fields */
-    bzero(&servaddr, slen);
-    bzero(&cliaddr, slen);
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(PORT);
-
-    external_ip = get_external_ip();
-    local_ip = get_local_ip();
 
-    debug(" - External IP: %s\n", external_ip);
-    debug(" - Local IP:    %s\n", local_ip);
+    if (!cache_get(hash, buf)) return 0;
 
-    /* create UDP socket */
+    /* a link stored or purged between the read and the cache_put would
+       leave the cache holding the old record */
+    pthread_mutex_lock(&store_lock);
+    roptions = leveldb_readoptions_create();
+    read = leveldb_get(db, roptions, hash, HASHLEN, &readlen, &err);
+    leveldb_readoptions_destroy(roptions);
+    if (err != NULL) {
+        pthread_mutex_unlock(&store_lock);
+        leveldb_free(err);
+        debug("[lookup] Database read failed\n");
+        return 1;
+    }
+    if (read == NULL) {
+        pthread_mutex_unlock(&store_lock);
+        return 1;
+    }
+
+    /* expired links are as good as purged */
+    unpackrecord(read, readlen, &first, &last);
+    if (expired(last, time(NULL))) {
+        pthread_mutex_unlock(&store_lock);
+        leveldb_free(read);
+        return 1;
+    }
+
+    readlen = linklen(read, readlen);
+    memcpy(buf, read, readlen);
+    buf[readlen] = '\0';
+    leveldb_free(read);
+
+    cache_put(hash, buf, last);
+    pthread_mutex_unlock(&store_lock);
+
+    return 0;
+}
+
+/* answer "g <hash>" and "m <hash> <hash> ..." with one "v <hash> <link>"
+   or "n <hash>" per hash, and "s" with the cache statistics; returns 1
+   if buf is not a query */
+int answer(int sockfd, struct sockaddr_in *addr, leveldb_t *db, const char *buf)
+{
+    int rc, n;
+    char hash[HASHLEN], link[BUFLEN], reply[BUFLEN + HASHLEN + 3];
+    const char *walk;
+
+    if ((buf[0] != 'g' && buf[0] != 'm' && buf[0] != 's') ||
+        (buf[1] != '\0' && buf[1] != ' ')) return 1;
+
+    if (buf[0] == 's') {
+        pthread_mutex_lock(&cache_lock);
+        snprintf(reply, BUFLEN, "s hits=%lu misses=%lu evictions=%lu entries=%d/%d bytes=%lu",
+                 cache.hits, cache.misses, cache.evictions, cache.count,
+                 cache.size, (unsigned long)cache.bytes);
+        pthread_mutex_unlock(&cache_lock);
+        rc = sendto(sockfd, reply, strlen(reply) + 1, 0, (struct sockaddr *)addr, sizeof *addr);
+        if (rc == -1 && errno != ENOBUFS && errno != EAGAIN)
+            die("[answer] Failed to send statistics");
+        return 0;
+    }
+
+    for (walk = buf + 1; sscanf(walk, "%40s%n", hash, &n) == 1; walk += n)
+    {
+        /* a link too long for one datagram cannot be answered */
+        if (!lookup(db, hash, link) &&
+            snprintf(reply, sizeof reply, "v %s %s", hash, link) < BUFLEN) {
+            debug(" - Found %s\n", hash);
+        } else {
+            snprintf(reply, BUFLEN, "n %s", hash);
+            debug(" - Not found %s\n", hash);
+        }
+        rc = sendto(sockfd, reply, strlen(reply) + 1, 0, (struct sockaddr *)addr, sizeof *addr);
+        if (rc == -1 && errno != ENOBUFS && errno != EAGAIN)
+            die("[answer] Failed to send link");
+        if (buf[0] == 'g') break;
+    }
+
+    return 0;
+}
+
+/* store a link pushed by another node: either a packet of a stream from
+   a sharing node, which is acknowledged, or a bare magnet link.  buf must
+   be NUL-padded to BUFLEN + 1 bytes. */
+void storelink(int sockfd, struct sockaddr_in *addr, leveldb_t *db, char *buf)
+{
+    const char *payload;
+    char type;
+    unsigned int id, seq;
+    long seen = 0;
+    size_t len;
+
+    /* acknowledge every packet of a stream pushed by a sharing node;
+       stray acks belong to streams that have already finished.  Only
+       nodes that sync with us are peers, not lookup clients. */
+    if (!parsepacket(buf, &type, &id, &seq, &payload)) {
+        if (type == 'a' || type == 'q') return;
+        peer_seen(inet_ntoa(addr->sin_addr));
+        sendack(sockfd, addr, id, seq, 0);
+        if (type == 'c') return;
+        seen = strtol(payload, (char **)&payload, 10);
+        if (*payload == ' ') payload++;
+        len = strlen(payload);
+        memmove(buf, payload, len);
+        bzero(buf + len, BUFLEN + 1 - len);
+    }
+
+    debug("Receive packet from %s:%d\n", inet_ntoa(addr->sin_addr),
+                                         ntohs(addr->sin_port));
+    parselink(db, buf, seen, "storelink");
+}
+
+/* hold a datagram back until the current stream is finished.  A request
+   for a range already queued from the same node replaces the older one,
+   since it carries the node's latest cursor.  Returns 1 if the queue is
+   full. */
+int enqueue(struct queue *q, const struct sockaddr_in *addr,
+            const char *buf, int len)
+{
+    int i;
+    unsigned int id;
+    struct range range, queued;
+    struct request *req = NULL;
+
+    if (!parserange(buf, &range, &id)) {
+        for (i = 0; i < q->count; i++)
+        {
+            req = &q->reqs[(q->head + i) % MAXQUEUE];
+            if (req->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+                req->addr.sin_port == addr->sin_port &&
+                !parserange(req->buf, &queued, &id) &&
+                !strcmp(queued.start, range.start) &&
+                !strcmp(queued.end, range.end)) break;
+            req = NULL;
+        }
+    }
+    if (req == NULL) {
+        if (q->count == MAXQUEUE) return 1;
+        req = &q->reqs[(q->head + q->count++) % MAXQUEUE];
+    }
+    req->addr = *addr;
+    req->len = len;
+    memcpy(req->buf, buf, len);
+    req->buf[len] = '\0';
+
+    return 0;
+}
+
+/* tell every node whose range request is held back that it is queued,
+   and behind how many others, so that it keeps waiting for its stream */
+void notify(int sockfd, const struct queue *q)
+{
+    int i, rc, ahead = 0;
+    unsigned int id;
+    char buf[BUFLEN];
+    struct range range;
+    const struct request *req;
+
+    for (i = 0; i < q->count; i++)
+    {
+        req = &q->reqs[(q->head + i) % MAXQUEUE];
+        if (parserange(req->buf, &range, &id)) continue;
+        snprintf(buf, BUFLEN, "q %u %d", id, ahead++);
+        rc = sendto(sockfd, buf, strlen(buf) + 1, 0, (struct sockaddr *)&req->addr,
+                    sizeof req->addr);
+        if (rc == -1 && errno != ENOBUFS && errno != EAGAIN)
+            die("[notify] Failed to send queue notice");
+    }
+}
+
+/* take the oldest datagram off the queue; returns 1 if it is empty */
+int dequeue(struct queue *q, struct sockaddr_in *addr, char *buf, int *len)
+{
+    struct request *req;
+
+    if (q->count == 0) return 1;
+    req = &q->reqs[q->head];
+    *addr = req->addr;
+    *len = req->len;
+    memcpy(buf, req->buf, req->len);
+    q->head = (q->head + 1) % MAXQUEUE;
+    q->count--;
+
+    return 0;
+}
+
+/* mark an in-flight packet acknowledged and open the window: by one
+   packet per ack in slow start, by one packet per window afterwards */
+void ackpacket(struct packet *pkt, double *cwnd, double ssthresh)
+{
+    if (pkt->state != QUEUED) return;
+    pkt->state = ACKED;
+
+    *cwnd += (*cwnd < ssthresh) ? 1 : 1 / *cwnd;
+    if (*cwnd > MAXWIN) *cwnd = MAXWIN;
+}
+
+/* open a stream of the links in its range, from a new iterator */
+void streamopen(struct stream *s, leveldb_t *db, leveldb_readoptions_t *roptions)
+{
+    s->window = calloc(MAXWIN, sizeof(struct packet));
+    if (s->window == NULL) die("[streamopen] Cannot allocate window");
+    s->iter = leveldb_create_iterator(db, roptions);
+    seekrange(s->iter, &s->range);
+
+    s->base = s->next = s->acked = 0;
+    s->done = s->finished = 0;
+    s->status = 1;
+    s->retransmits = 0;
+    s->start = s->progress = timenow();
+    s->lastcut = s->nextsend = 0;
+    s->cwnd = WIN_INIT;
+    s->ssthresh = MAXWIN;
+    s->srtt = s->rttvar = 0;
+    s->rto = RTO_INIT;
+}
+
+/* retransmit and send whatever is due on a stream at time t.  Returns how
+   long the stream can wait for acks before something else is due, or sets
+   finished once it is complete or abandoned. */
+double streamstep(int sockfd, struct stream *s, double t)
+{
+    int rc, len;
+    unsigned int seq;
+    long first, last;
+    double wait, due;
+    const char *hash, *link;
+    size_t hashlen, readlen;
+    struct packet *pkt;
+
+    if (s->done && s->base == s->next) {
+        debug(" - Transmission complete\n");
+        s->status = 0;
+        s->finished = 1;
+        return 0;
+    }
+    if (t - s->progress > SYNC_TIMEOUT) {
+        debug(" - Stream to %s timed out\n", inet_ntoa(s->addr.sin_addr));
+        s->finished = 1;
+        return 0;
+    }
+
+    /* retransmit packets whose ack is overdue, or that later acks have
+       overtaken */
+    for (seq = s->base; seq != s->next; seq++)
+    {
+        pkt = &s->window[seq % MAXWIN];
+        if (pkt->state != QUEUED) continue;
+        if (t - pkt->sent < s->rto &&
+            !(pkt->retries == 0 && s->acked >= seq + 1 + DUPTHRESH)) continue;
+        if (pkt->retries == MAXRETRY) {
+            debug(" - Stream to %s lost packet %u\n",
+                  inet_ntoa(s->addr.sin_addr), seq);
+            s->finished = 1;
+            return 0;
+        }
+
+        /* once only the closing packet is left, the receiver may just
+           have lost its ack and gone; it resumes the range if not */
+        if (s->done && s->base == s->next - 1 && pkt->retries == DUPTHRESH) {
+            debug(" - Stream to %s closed without ack\n",
+                  inet_ntoa(s->addr.sin_addr));
+            s->status = 0;
+            s->finished = 1;
+            return 0;
+        }
+        if (t - s->lastcut > s->srtt) {
+            s->ssthresh = (s->cwnd / 2 > WIN_MIN) ? s->cwnd / 2 : WIN_MIN;
+            s->cwnd = s->ssthresh;
+            if (t - pkt->sent >= s->rto)
+                s->rto = (s->rto * 2 < RTO_MAX) ? s->rto * 2 : RTO_MAX;
+            s->lastcut = t;
+        }
+        rc = sendto(sockfd, pkt->buf, pkt->len, 0, (struct sockaddr *)&s->addr, sizeof s->addr);
+        if (rc == -1 && errno != ENOBUFS && errno != EAGAIN)
+            die("[streamstep] Failed to resend link");
+        pkt->sent = t;
+        pkt->retries++;
+        s->retransmits++;
+    }
+
+    /* send new links while the window and the pacing interval allow */
+    while (!s->done && s->next - s->base < (unsigned int)s->cwnd && t >= s->nextsend)
+    {
+        pkt = &s->window[s->next % MAXWIN];
+        bzero(pkt->buf, BUFLEN);
+
+        /* skip links that have expired but not been purged yet */
+        hash = NULL;
+        for (; leveldb_iter_valid(s->iter); leveldb_iter_next(s->iter))
+        {
+            link = leveldb_iter_value(s->iter, &readlen);
+            unpackrecord(link, readlen, &first, &last);
+            if (!expired(last, (time_t)t)) {
+                hash = leveldb_iter_key(s->iter, &hashlen);
+                break;
+            }
+        }
+        if (hash != NULL && !(s->range.end[0] && keycmp(hash, hashlen, s->range.end) >= 0)) {
+            len = snprintf(pkt->buf, BUFLEN, "d %u %u %ld ", s->id, s->next, last);
+            readlen = linklen(link, readlen);
+            if (readlen > (size_t)(BUFLEN - len - 1)) readlen = BUFLEN - len - 1;
+            memcpy(pkt->buf + len, link, readlen);
+            len += readlen;
+            leveldb_iter_next(s->iter);
+        } else {
+            /* send "transmission complete" code */
+            len = snprintf(pkt->buf, BUFLEN, "c %u %u", s->id, s->next);
+            s->done = 1;
+        }
+        pkt->seq = s->next;
+        pkt->len = len + 1;
+        pkt->state = QUEUED;
+        pkt->retries = 0;
+        pkt->sent = t;
+
+        rc = sendto(sockfd, pkt->buf, pkt->len, 0, (struct sockaddr *)&s->addr, sizeof s->addr);
+        if (rc == -1 && errno != ENOBUFS && errno != EAGAIN)
+            die("[streamstep] Failed to send link");
+        s->next++;
+        s->nextsend = t + ((s->srtt > 0) ? s->srtt / s->cwnd : 0);
+    }
+
+    /* wait until the next send or resend is due */
+    wait = s->rto;
+    if (!s->done && s->next - s->base < (unsigned int)s->cwnd) wait = s->nextsend - t;
+    for (seq = s->base; seq != s->next; seq++)
+    {
+        pkt = &s->window[seq % MAXWIN];
+        if (pkt->state != QUEUED) continue;
+        due = pkt->sent + s->rto - t;
+        if (due < wait) wait = due;
+    }
+
+    return wait;
+}
+
+/* take an ack for packet seq, which also covers every packet before the
+   receiver's next one given in the payload */
+void streamack(struct stream *s, unsigned int seq, const char *payload)
+{
+    unsigned int cum;
+    double sample;
+    struct packet *pkt;
+
+    if (seq - s->base >= s->next - s->base) return;
+    s->progress = timenow();
+
+    pkt = &s->window[seq % MAXWIN];
+    if (pkt->state == QUEUED && pkt->retries == 0) {
+        /* sample the round trip time of packets sent only once */
+        sample = timenow() - pkt->sent;
+        if (s->srtt == 0) {
+            s->srtt = sample;
+            s->rttvar = sample / 2;
+        } else {
+            s->rttvar = 0.75 * s->rttvar + 0.25 * fabs(s->srtt - sample);
+            s->srtt = 0.875 * s->srtt + 0.125 * sample;
+        }
+        s->rto = s->srtt + 4 * s->rttvar;
+        if (s->rto < RTO_MIN) s->rto = RTO_MIN;
+        if (s->rto > RTO_MAX) s->rto = RTO_MAX;
+    }
+    if (seq + 1 > s->acked) s->acked = seq + 1;
+
+    if (sscanf(payload, "%u", &cum) != 1 || cum - s->base > s->next - s->base)
+        cum = s->base;
+    for (; cum != s->base; cum--)
+        ackpacket(&s->window[(cum - 1) % MAXWIN], &s->cwnd, s->ssthresh);
+    ackpacket(pkt, &s->cwnd, s->ssthresh);
+
+    /* slide the window past acknowledged packets */
+    while (s->base != s->next && s->window[s->base % MAXWIN].state == ACKED)
+    {
+        s->window[s->base % MAXWIN].state = FREE;
+        s->base++;
+    }
+}
+
+void streamclose(struct stream *s)
+{
+    peer_rtt(inet_ntoa(s->addr.sin_addr), s->srtt);
+    debug(" - Sent %u packets to %s in %.2fs [%ld resent, srtt %.1fms, cwnd %.1f]\n",
+          s->next, inet_ntoa(s->addr.sin_addr), timenow() - s->start,
+          s->retransmits, s->srtt * 1000, s->cwnd);
+
+    leveldb_iter_destroy(s->iter);
+    free(s->window);
+    s->finished = 1;
+}
+
+/* stream the links in each stream's range to its node as numbered packets
+   and wait for every one to be acknowledged.  Lost packets are
+   retransmitted after a timeout, or as soon as DUPTHRESH later packets
+   have been acknowledged; each window grows per ack and halves once per
+   round trip on loss, and sends are paced at one per srtt / cwnd.  Each
+   stream's status is 0 once its closing packet is acknowledged, or 1 if
+   it was abandoned; returns the number of streams abandoned. */
+int sendlinks(int sockfd, leveldb_t *db, struct stream *streams, int num_streams,
+              struct queue *pending)
+{
+    int rc, i, ours, active, failed = 0;
+    unsigned int seq, ackid;
+    double t, wait, due, notified = 0;
+    char buf[BUFLEN + 1], type;
+    const char *payload;
+    struct stream *s;
+    struct range other;
+    struct sockaddr_in recvaddr;
+    struct pollfd pfd;
+    socklen_t slen = sizeof recvaddr;
+    leveldb_readoptions_t *roptions;
+
+    roptions = leveldb_readoptions_create();
+    for (i = 0; i < num_streams; i++) streamopen(&streams[i], db, roptions);
+    active = num_streams;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+
+    while (active > 0)
+    {
+        /* step every stream, and sleep until an ack arrives or the next
+           send or resend is due on any of them */
+        t = timenow();
+        wait = RTO_MAX;
+        for (i = 0; i < num_streams; i++)
+        {
+            s = &streams[i];
+            if (s->finished) continue;
+            due = streamstep(sockfd, s, t);
+            if (s->finished) {
+                failed += s->status;
+                streamclose(s);
+                active--;
+            } else if (due < wait) {
+                wait = due;
+            }
+        }
+        if (active == 0) break;
+
+        /* keep queued requests from looking stalled */
+        if (pending != NULL && pending->count && t - notified >= QUEUE_NOTIFY) {
+            notify(sockfd, pending);
+            notified = t;
+        }
+        if (wait > 0) {
+            rc = poll(&pfd, 1, (int)(wait * 1000) + 1);
+            if (rc == -1 && errno != EINTR) die("[sendlinks] poll failed");
+        }
+
+        /* collect acks */
+        while ( (rc = recvfrom(sockfd, buf, BUFLEN, MSG_DONTWAIT, (struct sockaddr *)&recvaddr, &slen)) >= 0)
+        {
+            bzero(buf + rc, BUFLEN + 1 - rc);
+            s = NULL;
+            if (!parsepacket(buf, &type, &ackid, &seq, &payload) && type == 'a') {
+                for (i = 0; i < num_streams && s == NULL; i++)
+                {
+                    if (!streams[i].finished && streams[i].id == ackid &&
+                        streams[i].addr.sin_addr.s_addr == recvaddr.sin_addr.s_addr &&
+                        streams[i].addr.sin_port == recvaddr.sin_port)
+                        s = &streams[i];
+                }
+            }
+            if (s != NULL) {
+                streamack(s, seq, payload);
+                continue;
+            }
+            if (pending == NULL) continue;
+
+            /* answer lookups and store links pushed by other nodes right
+               away, so that neither waits for these streams, and hold
+               requests and anything else back until they are done */
+            if (!answer(sockfd, &recvaddr, db, buf)) continue;
+            if (parserange(buf, &other, &ackid) &&
+                !parsepacket(buf, &type, &ackid, &seq, &payload)) {
+                storelink(sockfd, &recvaddr, db, buf);
+                continue;
+            }
+            if (enqueue(pending, &recvaddr, buf, rc))
+                debug(" - Drop datagram from %s:%d\n",
+                      inet_ntoa(recvaddr.sin_addr), ntohs(recvaddr.sin_port));
+
+            /* a request for a range being streamed means that its receiver
+               has given up on the stream and is resuming it; any other is
+               told right away that it is queued */
+            if (parserange(buf, &other, &ackid)) continue;
+            notified = 0;
+            for (i = 0; i < num_streams; i++)
+            {
+                s = &streams[i];
+                ours = s->addr.sin_addr.s_addr == recvaddr.sin_addr.s_addr &&
+                       s->addr.sin_port == recvaddr.sin_port;
+                if (s->finished || !ours || strcmp(other.start, s->range.start) ||
+                    strcmp(other.end, s->range.end)) continue;
+                debug(" - Stream to %s superseded\n", inet_ntoa(s->addr.sin_addr));
+                failed++;
+                streamclose(s);
+                active--;
+            }
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            die("[sendlinks] recvfrom failed");
+    }
+    leveldb_readoptions_destroy(roptions);
+
+    return failed;
+}
+
+/* delete the links that have not been seen for TTL seconds, in batches
+   with a pause between them so the serve loop keeps its share of the
+   database, then compact the key range they occupied */
+void purgelinks(leveldb_t *db)
+{
+    char *err = NULL, *value, record[RECLEN];
+    char keys[PURGE_BATCH][HASHLEN + 1], lo[HASHLEN], hi[HASHLEN];
+    const char *key, *scan;
+    size_t keylens[PURGE_BATCH];
+    size_t keylen, readlen, reclen, lolen = 0, hilen = 0;
+    long first, last;
+    unsigned long scanned = 0, purged = 0, stamped = 0;
+    int i, n;
+    double start;
+    time_t now;
+    leveldb_readoptions_t *roptions;
+    leveldb_writeoptions_t *woptions;
+    leveldb_writebatch_t *batch;
+    leveldb_iterator_t *iter;
+
+    /* a full scan should not push hot blocks out of the block cache */
+    roptions = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(roptions, 0);
+    woptions = leveldb_writeoptions_create();
+    batch = leveldb_writebatch_create();
+    iter = leveldb_create_iterator(db, roptions);
+
+    start = timenow();
+    now = time(NULL);
+
+    leveldb_iter_seek_to_first(iter);
+    while (leveldb_iter_valid(iter))
+    {
+        /* collect a batch of keys whose records look stale in the scan */
+        for (n = 0; n < PURGE_BATCH && leveldb_iter_valid(iter); leveldb_iter_next(iter))
+        {
+            key = leveldb_iter_key(iter, &keylen);
+            scan = leveldb_iter_value(iter, &readlen);
+            scanned++;
+            if (!unpackrecord(scan, readlen, &first, &last) && !expired(last, now))
+                continue;
+            if (keylen > HASHLEN) keylen = HASHLEN;
+            memcpy(keys[n], key, keylen);
+            keys[n][keylen] = '\0';
+            keylens[n++] = keylen;
+        }
+        if (!n) break;
+
+        /* links may have been stored since the scan began, so decide on
+           each record as it is now */
+        pthread_mutex_lock(&store_lock);
+        for (i = 0; i < n; i++)
+        {
+            value = leveldb_get(db, roptions, keys[i], keylens[i], &readlen, &err);
+            if (err != NULL) {
+                leveldb_free(err);
+                err = NULL;
+                debug("[purgelinks] Database read failed\n");
+            }
+            if (value == NULL) continue;
+
+            if (unpackrecord(value, readlen, &first, &last)) {
+                /* links stored before records carried their age start now */
+                reclen = packrecord(record, value, linklen(value, readlen), now, now);
+                leveldb_writebatch_put(batch, keys[i], keylens[i], record, reclen);
+                stamped++;
+            } else if (expired(last, now)) {
+                leveldb_writebatch_delete(batch, keys[i], keylens[i]);
+                cache_del(keys[i]);
+                if (!lolen) {
+                    memcpy(lo, keys[i], keylens[i]);
+                    lolen = keylens[i];
+                }
+                memcpy(hi, keys[i], keylens[i]);
+                hilen = keylens[i];
+                purged++;
+            }
+            leveldb_free(value);
+        }
+        leveldb_write(db, woptions, batch, &err);
+        pthread_mutex_unlock(&store_lock);
+        if (err != NULL) {
+            leveldb_free(err);
+            err = NULL;
+            debug("[purgelinks] Database write failed\n");
+        }
+        leveldb_writebatch_clear(batch);
+        usleep(PURGE_PAUSE);
+    }
+
+    leveldb_iter_destroy(iter);
+    leveldb_writebatch_destroy(batch);
+    leveldb_writeoptions_destroy(woptions);
+    leveldb_readoptions_destroy(roptions);
+
+    /* reclaim the space held by the deleted links */
+    if (purged) leveldb_compact_range(db, lo, lolen, hi, hilen);
+
+    debug("Purge: %lu links scanned, %lu expired, %lu stamped in %.2fs\n",
+          scanned, purged, stamped, timenow() - start);
+}
+
+void *purge(void *arg)
+{
+    leveldb_t *db = arg;
+
+    loop
+    {
+        purgelinks(db);
+        sleep(PURGE_INTERVAL);
+    }
+
+    return NULL;
+}
+
+void runserver(void)
+{
+    debug("Start server...\n");
+    const char *_fn = "runserver";
+
+    int sockfd, rc, reuse, rcvbuf;
+    char buf[BUFLEN + 1];
+    char *external_ip, *local_ip, *walk, *next, *read, *err = NULL;
+    char *xl, *dl;
+    unsigned int id;
+    time_t lastsave;
+    pthread_t purger;
+    struct params magnet;
+    struct range range;
+    struct stream stream;
+    struct queue pending;
+    struct sockaddr_in servaddr, cliaddr;
+    socklen_t slen = sizeof servaddr;
+    leveldb_t *db;
+    leveldb_options_t *options;
+    leveldb_writeoptions_t *woptions;
+
+    /* zero and set server socket struct fields */
+    bzero(&servaddr, slen);
+    bzero(&cliaddr, slen);
+    bzero(&pending, sizeof pending);
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(PORT);
+
+    external_ip = get_external_ip();
+    local_ip = get_local_ip();
+
+    debug(" - External IP: %s\n", external_ip);
+    debug(" - Local IP:    %s\n", local_ip);
+
+    /* create UDP socket */
     sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sockfd < 0) die("[runserver] Unable to create socket");
 
@@ -258,69 +1586,74 @@ void runserver(void)
     rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
     if (rc < 0) debug("[%s] Cannot set socket to reuse\n", _fn);
 
+    /* make room for a full window from every node streaming to us */
+    rcvbuf = RCVBUF;
+    rc = setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    if (rc < 0) debug("[%s] Cannot set socket receive buffer\n", _fn);
+
     /* bind socket to address */
     rc = bind(sockfd, (struct sockaddr *)&servaddr, slen);
     if (rc < 0) die("[runserver] Failed to bind socket");
 
     /* create the db if it doesn't exist already */
     options = leveldb_options_create();
-    roptions = leveldb_readoptions_create();
     leveldb_options_set_create_if_missing(options, 1);
 
     /* open database */
     db = leveldb_open(options, DB, &err);
 
-    loop
-    {
-        /* wait for incoming socket data */
-        rc = recvfrom(sockfd, buf, BUFLEN, 0, (struct sockaddr *)&cliaddr, &slen);
-        if (rc == -1) die("[runserver] recvfrom failed");
-        /* debug("Data: %s\n", buf); */
+    /* keep hot links in memory for lookups */
+    cache_init(CACHE_SIZE);
 
-        /* if this is a link request, send all links in database */
-        if (!strncmp(buf, "r", BUFLEN)) {
-            debug("Link request from %s:%d\n", inet_ntoa(cliaddr.sin_addr),
-                                               ntohs(cliaddr.sin_port));
-            leveldb_iterator_t* iter;
+    /* remember the peers we hear from */
+    peers_load();
+    lastsave = time(NULL);
 
-            /* leveldb iterator */
-            iter = leveldb_create_iterator(db, roptions);
-
-            /* send links to node */
-            leveldb_iter_seek_to_first(iter);
-            while (leveldb_iter_valid(iter))
-            {
-                remain = BUFLEN;
-                hash = leveldb_iter_key(iter, &hashlen);
-                link = leveldb_iter_value(iter, &readlen);
-
-                /* send magnet link */
-                strlcpy(buf, link, BUFLEN);
-                bufptr = (char *)&buf;
-                while (remain > 0) {
-                    rc = sendto(sockfd, bufptr, remain, 0, (struct sockaddr *)&cliaddr, slen);
-                    if (rc == -1) die("[runserver] Failed to send link");
-                    debug(" - Sent %s [%d bytes]\n", hash, rc);
-                    remain -= rc;
-                    bufptr += rc;
-                }
+    /* expire stale links in the background */
+    if (TTL) {
+        rc = pthread_create(&purger, NULL, purge, db);
+        if (rc) debug("[%s] Cannot start purge thread\n", _fn);
+    }
 
-                leveldb_iter_next(iter);
-            }
+    loop
+    {
+        /* serve datagrams held back during the last stream first,
+           otherwise wait for incoming socket data */
+        if (dequeue(&pending, &cliaddr, buf, &rc)) {
+            rc = recvfrom(sockfd, buf, BUFLEN, 0, (struct sockaddr *)&cliaddr, &slen);
+            if (rc == -1) die("[runserver] recvfrom failed");
+        }
+        bzero(buf + rc, BUFLEN + 1 - rc);
 
-            /* send "transmission complete" code */
-            rc = sendto(sockfd, "c", 2, 0, (struct sockaddr *)&cliaddr, slen);
-            if (rc == -1) die("[runserver] transmission complete sendto failed");
-            debug(" - Transmission complete\n");
+        if (time(NULL) - lastsave >= PEER_SAVE) {
+            peers_age(time(NULL));
+            peers_save();
+            lastsave = time(NULL);
+        }
+        /* debug("Data: %s\n", buf); */
 
-            leveldb_iter_destroy(iter);
+        /* if this is a link request, send the links in the requested range */
+        if (!parserange(buf, &range, &id)) {
+            debug("Link request from %s:%d [%s:%s after %s]\n",
+                  inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port),
+                  range.start, range.end, range.cursor);
+            peer_seen(inet_ntoa(cliaddr.sin_addr));
+            bzero(&stream, sizeof stream);
+            stream.addr = cliaddr;
+            stream.range = range;
+            stream.id = id;
+            sendlinks(sockfd, db, &stream, 1, &pending);
+            continue;
+        }
 
+        /* answer lookups from the cache, or the database on a miss */
+        if (!answer(sockfd, &cliaddr, db, buf)) {
+            debug("Lookup from %s:%d\n", inet_ntoa(cliaddr.sin_addr),
+                                         ntohs(cliaddr.sin_port));
             continue;
         }
 
-        debug("Receive packet from %s:%d\n", inet_ntoa(cliaddr.sin_addr),
-                                             ntohs(cliaddr.sin_port));
-        parselink(db, buf, _fn);
+        storelink(sockfd, &cliaddr, db, buf);
     }
 
     leveldb_close(db);
@@ -331,41 +1664,230 @@ void runserver(void)
     exit(0);
 }
 
-void share(const char *ip)
+/* divide the infohash keyspace evenly between n pulls */
+void splitrange(struct pull *pulls, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        bzero(&pulls[i].range, sizeof(struct range));
+        if (i > 0)
+            snprintf(pulls[i].range.start, HASHLEN, "%02x", 256 * i / n);
+        if (i < n - 1)
+            snprintf(pulls[i].range.end, HASHLEN, "%02x", 256 * (i + 1) / n);
+    }
+}
+
+/* ask a node for the rest of a range, starting after its cursor */
+void requestrange(int sockfd, struct pull *pull)
+{
+    int rc, i;
+    char buf[BUFLEN];
+    struct range *range = &pull->range;
+
+    /* each request opens a new stream, so stale packets can be told apart */
+    pull->id = (unsigned int)rand();
+    pull->next = 0;
+    pull->ordered = 1;
+    for (i = 0; i < MAXWIN; i++) pull->window[i].state = FREE;
+
+    snprintf(buf, BUFLEN, "r %s %s %s %u", range->start[0] ? range->start : "-",
+                                           range->end[0] ? range->end : "-",
+                                           range->cursor[0] ? range->cursor : "-",
+                                           pull->id);
+    debug(" - Link request to %s: %s\n", inet_ntoa(pull->addr.sin_addr), buf);
+
+    rc = sendto(sockfd, buf, strlen(buf) + 1, 0, (struct sockaddr *)&pull->addr,
+                sizeof pull->addr);
+    if (rc == -1) die("[share] Link request failed");
+
+    pull->active = 1;
+    pull->done = 0;
+    pull->queued = 0;
+    pull->last = time(NULL);
+    pull->started = timenow();
+}
+
+/* write out the links a pull has merged so far */
+void mergeflush(leveldb_t *db, struct pull *pull)
+{
+    char *err = NULL;
+    leveldb_writeoptions_t *woptions;
+
+    if (!pull->batched) return;
+
+    woptions = leveldb_writeoptions_create();
+    leveldb_write(db, woptions, pull->batch, &err);
+    if (err != NULL) {
+        leveldb_free(err);
+        debug("[mergeflush] Database write failed\n");
+    }
+    leveldb_writeoptions_destroy(woptions);
+    leveldb_writebatch_clear(pull->batch);
+    pull->batched = 0;
+}
+
+/* flush a pull's merged links and release its iterator */
+void mergeend(leveldb_t *db, struct pull *pull)
+{
+    mergeflush(db, pull);
+    if (pull->iter != NULL) {
+        leveldb_iter_destroy(pull->iter);
+        pull->iter = NULL;
+    }
+}
+
+/* ranges stream in key order, so each link is matched against a local
+   iterator walking the same keys in lockstep, merge-join style: a few
+   steps forward, or a seek when the gap is wider, instead of a random
+   read per link.  Only new or changed records are written, in batches.
+   A stream that turns out not to be ordered falls back to parselink(). */
+void mergelink(leveldb_t *db, struct pull *pull, char *link, long seen)
+{
+    char hash[HASHLEN], record[RECLEN];
+    const char *key, *stored = NULL;
+    size_t keylen, storedlen = 0, reclen;
+    int steps;
+    leveldb_readoptions_t *roptions;
+
+    if (linkhash(link, hash)) {
+        debug(" - Skip: infohash not found\n");
+        return;
+    }
+    if (pull->ordered && pull->range.cursor[0] && strcmp(hash, pull->range.cursor) <= 0) {
+        debug(" - Stream from %s is not ordered\n", inet_ntoa(pull->addr.sin_addr));
+        mergeend(db, pull);
+        pull->ordered = 0;
+    }
+    if (!pull->ordered) {
+        parselink(db, link, seen, "share");
+        return;
+    }
+
+    /* advance the local iterator to the first key not below hash */
+    if (pull->iter == NULL) {
+        roptions = leveldb_readoptions_create();
+        pull->iter = leveldb_create_iterator(db, roptions);
+        leveldb_readoptions_destroy(roptions);
+        leveldb_iter_seek(pull->iter, hash, strlen(hash));
+    }
+    for (steps = 0; leveldb_iter_valid(pull->iter); steps++)
+    {
+        key = leveldb_iter_key(pull->iter, &keylen);
+        if (keycmp(key, keylen, hash) >= 0) break;
+        if (steps == MERGE_STEPS) {
+            leveldb_iter_seek(pull->iter, hash, strlen(hash));
+            continue;
+        }
+        leveldb_iter_next(pull->iter);
+    }
+    if (leveldb_iter_valid(pull->iter)) {
+        key = leveldb_iter_key(pull->iter, &keylen);
+        if (!keycmp(key, keylen, hash))
+            stored = leveldb_iter_value(pull->iter, &storedlen);
+    }
+
+    reclen = mergerecord(record, link, seen, stored, storedlen);
+    if (!reclen) {
+        pull->unchanged++;
+        return;
+    }
+    debug(" - Save link to database\n");
+    cache_del(hash);
+    leveldb_writebatch_put(pull->batch, hash, HASHLEN, record, reclen);
+    pull->written++;
+    if (++pull->batched == MERGE_BATCH) mergeflush(db, pull);
+}
+
+/* acknowledge a packet of a pulled stream and buffer it, then hand the
+   links that are now in order to the database, advancing the cursor */
+void recvpacket(int sockfd, leveldb_t *db, struct pull *pull, char type,
+                unsigned int seq, const char *payload)
+{
+    char hash[HASHLEN], *link;
+    long seen;
+    struct packet *pkt;
+
+    /* packets past the window cannot have been sent yet */
+    if (seq - pull->next >= MAXWIN) {
+        if (seq < pull->next)
+            sendack(sockfd, &pull->addr, pull->id, seq, pull->next);
+        return;
+    }
+
+    pkt = &pull->window[seq % MAXWIN];
+    if (pkt->state == QUEUED) {
+        sendack(sockfd, &pull->addr, pull->id, seq, pull->next);
+        return;
+    }
+    pkt->state = QUEUED;
+    pkt->seq = seq;
+    pkt->len = (type == 'c') ? -1 : (int)strlen(payload);
+    bzero(pkt->buf, BUFLEN);
+    if (pkt->len > 0) memcpy(pkt->buf, payload, pkt->len);
+
+    while (pull->window[pull->next % MAXWIN].state == QUEUED)
+    {
+        pkt = &pull->window[pull->next % MAXWIN];
+        pkt->state = FREE;
+        pull->next++;
+
+        /* stop expecting links when transmission complete packet received */
+        if (pkt->len < 0) {
+            mergeend(db, pull);
+            debug(" - Transmission complete [%lu written, %lu unchanged]\n",
+                  pull->written, pull->unchanged);
+            pull->active = 0;
+            pull->done = 1;
+            break;
+        }
+
+        seen = strtol(pkt->buf, &link, 10);
+        if (*link == ' ') link++;
+        mergelink(db, pull, link, seen);
+        if (!linkhash(link, hash)) strlcpy(pull->range.cursor, hash, HASHLEN);
+    }
+    sendack(sockfd, &pull->addr, pull->id, seq, pull->next);
+}
+
+void share(const char **ips, int num_ips)
 {
     const char *_fn = "share";
 
-    int sockfd, rc, remain, reuse, len;
-    char buf[BUFLEN], *bufptr, *walk, *next, *read, *xl, *dl, *err = NULL;
-    const char *hash, *link;
-    size_t readlen;
-    size_t hashlen = HASHLEN;
-    struct params magnet;
-    struct node *root;
-    struct node *peer;
-    struct sockaddr_in servaddr, xtrnaddr, recvaddr;
-    socklen_t slen = sizeof servaddr;
+    int sockfd, rc, reuse, rcvbuf, i, j, remaining, stalled;
+    unsigned int id, seq, delivered;
+    char buf[BUFLEN + 1], type, *err = NULL;
+    const char *payload;
+    time_t now, progress;
+    struct pull *pulls, *pull;
+    struct stream *pushes;
+    struct sockaddr_in recvaddr;
+    struct timeval tv;
+    socklen_t slen = sizeof recvaddr;
     leveldb_t *db;
     leveldb_options_t *options;
-    leveldb_readoptions_t *roptions;
-    leveldb_writeoptions_t *woptions;
-    leveldb_iterator_t* iter;
 
-    /* zero and populate sockaddr_in fields */
-    bzero(&servaddr, slen);
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(PORT);
+    peers_load();
 
-    bzero(&xtrnaddr, slen);
-    xtrnaddr.sin_family = AF_INET;
-    xtrnaddr.sin_port = htons(PORT);
+    if (num_ips > MAXPEERS) num_ips = MAXPEERS;
+    pulls = calloc(num_ips, sizeof(struct pull));
+    if (pulls == NULL) die("[share] Cannot allocate pulls");
 
-    bzero(&recvaddr, slen);
+    /* convert input ips to network addresses */
+    for (i = 0; i < num_ips; i++)
+    {
+        pulls[i].addr.sin_family = AF_INET;
+        pulls[i].addr.sin_port = htons(PORT);
+        rc = inet_pton(AF_INET, ips[i], &pulls[i].addr.sin_addr);
+        if (rc <= 0) die("[share] Cannot convert network IP");
+        pulls[i].window = calloc(MAXWIN, sizeof(struct packet));
+        if (pulls[i].window == NULL) die("[share] Cannot allocate window");
+        pulls[i].batch = leveldb_writebatch_create();
+    }
+    srand(time(NULL) ^ getpid());
 
-    /* convert input ip to network address */
-    rc = inet_pton(AF_INET, ip, &xtrnaddr.sin_addr);
-    if (rc <= 0) die("[share] Cannot convert network IP");
+    bzero(&recvaddr, slen);
 
     /* create UDP socket */
     sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -376,82 +1898,240 @@ void share(const char *ip)
     rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
     if (rc < 0) die("[share] Cannot set socket to reuse");
 
+    /* time out receives, so that stalled ranges can be resumed */
+    tv.tv_sec = SYNC_WAIT;
+    tv.tv_usec = 0;
+    rc = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    if (rc < 0) die("[share] Cannot set socket timeout");
+
+    /* make room for a full window from every node */
+    rcvbuf = RCVBUF;
+    rc = setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    if (rc < 0) debug("[%s] Cannot set socket receive buffer\n", _fn);
+
     /* open leveldb */
     options = leveldb_options_create();
-    roptions = leveldb_readoptions_create();
     leveldb_options_set_create_if_missing(options, 1);
     db = leveldb_open(options, DB, &err);
     if (err != NULL) die("[share] Could not open LevelDB");
     leveldb_free(err);
     err = NULL;
 
-    /* leveldb iterator */
-    iter = leveldb_create_iterator(db, roptions);
-
-    /* send links */
+    /* send links to every node at once, each over its own window */
     debug("Share links:\n");
-    leveldb_iter_seek_to_first(iter);
-    while (leveldb_iter_valid(iter))
+    pushes = calloc(num_ips, sizeof(struct stream));
+    if (pushes == NULL) die("[share] Cannot allocate pushes");
+    for (i = 0; i < num_ips; i++)
     {
-        remain = BUFLEN;
-        hash = leveldb_iter_key(iter, &hashlen);
-        link = leveldb_iter_value(iter, &readlen);
+        pushes[i].addr = pulls[i].addr;
+        pushes[i].id = (unsigned int)rand();
+    }
+    sendlinks(sockfd, db, pushes, num_ips, NULL);
+    free(pushes);
+
+    /* request a slice of the keyspace from each node */
+    splitrange(pulls, num_ips);
+    for (i = 0; i < num_ips; i++) requestrange(sockfd, &pulls[i]);
+    remaining = num_ips;
+    progress = time(NULL);
+
+    /* receive links until every range is complete or abandoned, or no
+       node has sent anything for SYNC_TIMEOUT seconds */
+    while (remaining > 0 && time(NULL) - progress < SYNC_TIMEOUT)
+    {
+        rc = recvfrom(sockfd, buf, BUFLEN, 0, (struct sockaddr *)&recvaddr, &slen);
+        if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            die("[share] recvfrom failed");
+        now = time(NULL);
+
+        if (rc >= 0) {
+            bzero(buf + rc, BUFLEN + 1 - rc);
+
+            /* find the pull this stream belongs to */
+            pull = NULL;
+            if (!parsepacket(buf, &type, &id, &seq, &payload) && type != 'a') {
+                for (i = 0; i < num_ips; i++)
+                {
+                    if (pulls[i].id == id &&
+                        pulls[i].addr.sin_addr.s_addr == recvaddr.sin_addr.s_addr &&
+                        pulls[i].addr.sin_port == recvaddr.sin_port) {
+                        pull = &pulls[i];
+                        break;
+                    }
+                }
+            }
 
-        /* send magnet link */
-        strlcpy(buf, link, BUFLEN);
-        bufptr = (char *)&buf;
-        while (remain > 0) {
-            rc = sendto(sockfd, bufptr, remain, 0, (struct sockaddr *)&xtrnaddr, sizeof xtrnaddr);
-            if (rc == -1) die("[share] Link share failed");
-            debug(" - Sent %s to %s [%d bytes]\n", hash, inet_ntoa(xtrnaddr.sin_addr), rc);
-            remain -= rc;
-            bufptr += rc;
+            /* a busy node has queued the request: the pull is waiting for
+               its turn, not stalled */
+            if (pull != NULL && pull->active && type == 'q') {
+                if (!pull->queued)
+                    debug(" - Range %s:%s queued by %s behind %u others\n",
+                          pull->range.start, pull->range.end,
+                          inet_ntoa(pull->addr.sin_addr), seq);
+                pull->last = progress = now;
+                pull->queued = 1;
+
+                /* the cost per link is measured from the end of the wait */
+                pull->started = timenow();
+
+            /* a finished stream only needs its closing packet acked again */
+            } else if (pull != NULL && pull->active) {
+                pull->last = progress = now;
+                delivered = pull->next;
+                recvpacket(sockfd, db, pull, type, seq, payload);
+
+                /* only stalls in a row count against a range */
+                if (pull->next != delivered) pull->resumes = 0;
+                /* the request's round trip dominates small slices, so
+                   only larger ones measure the peer's cost per link */
+                if (!pull->active) {
+                    delivered = pull->next - 1;
+                    peer_measure(inet_ntoa(pull->addr.sin_addr), 0,
+                                 (delivered >= PEER_MINLINKS) ?
+                                 (timenow() - pull->started) / delivered : 0, 0);
+                    remaining--;
+                }
+            } else if (pull != NULL && type != 'q' && seq < pull->next) {
+                sendack(sockfd, &pull->addr, pull->id, seq, pull->next);
+            }
         }
 
-        leveldb_iter_next(iter);
+        /* resume stalled ranges from their cursor, moving them to a node
+           that has already finished its own range when there is one */
+        for (i = 0; i < num_ips; i++)
+        {
+            pull = &pulls[i];
+            if (!pull->active || now - pull->last < SYNC_WAIT) continue;
+
+            /* time spent queued before the first packet is not a stall;
+               a stream that stalled, or a node that never answered, is
+               a failure of that node */
+            stalled = !(pull->queued && pull->next == 0);
+            if (stalled) peer_measure(inet_ntoa(pull->addr.sin_addr), 0, 0, 1);
+            if (stalled && ++pull->resumes > MAXRESUME) {
+                debug(" - Give up on range %s:%s from %s after %s\n",
+                      pull->range.start, pull->range.end,
+                      inet_ntoa(pull->addr.sin_addr), pull->range.cursor);
+                pull->active = 0;
+                remaining--;
+                continue;
+            }
+            for (j = 0; j < num_ips; j++)
+            {
+                if (!pulls[j].active && pulls[j].done) {
+                    pull->addr = pulls[j].addr;
+                    pulls[j].done = 0;
+                    break;
+                }
+            }
+            mergeend(db, pull);
+            requestrange(sockfd, pull);
+        }
     }
 
-    /* request links from node */
-    debug(" - Link request\n");
-    rc = sendto(sockfd, "r", 2, 0, (struct sockaddr *)&xtrnaddr, sizeof xtrnaddr);
-    if (rc == -1) die("[share] Link request failed");
-
-    /* wait for incoming socket data, block until "transmission complete"
-       signal received from node (TODO use TCP sockets?) */
-    loop
+    for (i = 0; i < num_ips; i++)
     {
-        /* wait for incoming socket data (TODO timeout and/or nonblocking?) */
-        rc = recvfrom(sockfd, buf, BUFLEN, 0, (struct sockaddr *)&recvaddr, &slen);
-        if (rc == -1) die("[share] recvfrom failed");
+        if (pulls[i].active)
+            debug(" - Range %s:%s from %s incomplete after %s\n",
+                  pulls[i].range.start, pulls[i].range.end,
+                  inet_ntoa(pulls[i].addr.sin_addr), pulls[i].range.cursor);
+        mergeend(db, &pulls[i]);
+        leveldb_writebatch_destroy(pulls[i].batch);
+        free(pulls[i].window);
+    }
+    free(pulls);
+    peers_save();
+    leveldb_close(db);
 
-        debug(" - Receive packet from %s:%d\n", inet_ntoa(recvaddr.sin_addr),
-                                                ntohs(recvaddr.sin_port));
+    if (close(sockfd) == -1) exit(1);
+}
 
-        /* stop expecting links when transmission complete packet received */
-        if (!strncmp(buf, "c", BUFLEN)) {
-            debug(" - Transmission complete\n");
-            break;
-        }
+/* look up hashes on a node, printing each link, "not found" for the
+   hashes it does not have, or its cache statistics when none are given */
+void query(const char *ip, char **hashes, int num_hashes)
+{
+    int sockfd, rc, i, tries, remaining;
+    char buf[BUFLEN + 1], hash[HASHLEN], *answered;
+    struct sockaddr_in xtrnaddr, recvaddr;
+    struct timeval tv;
+    socklen_t slen = sizeof recvaddr;
 
-        parselink(db, buf, _fn);
-    }
+    bzero(&xtrnaddr, sizeof xtrnaddr);
+    xtrnaddr.sin_family = AF_INET;
+    xtrnaddr.sin_port = htons(PORT);
+    rc = inet_pton(AF_INET, ip, &xtrnaddr.sin_addr);
+    if (rc <= 0) die("[query] Cannot convert network IP");
+
+    /* create UDP socket */
+    sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sockfd < 0) die("[query] Unable to create socket");
+
+    tv.tv_sec = SYNC_WAIT;
+    tv.tv_usec = 0;
+    rc = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    if (rc < 0) die("[query] Cannot set socket timeout");
+
+    answered = calloc(num_hashes + 1, 1);
+    if (answered == NULL) die("[query] Cannot allocate answers");
+    remaining = (num_hashes > 0) ? num_hashes : 1;
+
+    for (tries = 0; remaining > 0 && tries < MAXRESUME; tries++)
+    {
+        /* batch every unanswered hash into as few requests as fit */
+        strlcpy(buf, (num_hashes > 0) ? "m" : "s", BUFLEN);
+        for (i = 0; i <= num_hashes; i++)
+        {
+            if (i == num_hashes || strlen(buf) + HASHLEN + 1 > BUFLEN) {
+                if (strlen(buf) > 1 || num_hashes == 0) {
+                    rc = sendto(sockfd, buf, strlen(buf) + 1, 0,
+                                (struct sockaddr *)&xtrnaddr, sizeof xtrnaddr);
+                    if (rc == -1) die("[query] Lookup request failed");
+                }
+                strlcpy(buf, "m", BUFLEN);
+            }
+            if (i < num_hashes && !answered[i]) {
+                strlcat(buf, " ", BUFLEN);
+                strlcat(buf, hashes[i], BUFLEN);
+            }
+        }
 
-    /* receive peers from node */
-    root = malloc(sizeof(struct node));
-    root->next = 0;
-    root->ip = "127.0.0.1";
-    peer = root;
-    if (peer != 0) {
-        while (peer->next != 0)
+        /* collect answers until they stop arriving */
+        while (remaining > 0)
         {
-            peer = peer->next;
+            rc = recvfrom(sockfd, buf, BUFLEN, 0, (struct sockaddr *)&recvaddr, &slen);
+            if (rc == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                die("[query] recvfrom failed");
+            }
+            buf[rc] = '\0';
+
+            if (buf[0] == 's' && num_hashes == 0) {
+                printf("%s\n", buf + 2);
+                remaining = 0;
+                break;
+            }
+            if ((buf[0] != 'v' && buf[0] != 'n') ||
+                sscanf(buf + 1, "%40s", hash) != 1) continue;
+            for (i = 0; i < num_hashes; i++)
+            {
+                if (answered[i] || strncmp(hashes[i], hash, HASHLEN)) continue;
+                answered[i] = 1;
+                remaining--;
+                if (buf[0] == 'v')
+                    printf("%s\n", buf + 3 + strlen(hash));
+                else
+                    printf("%s: not found\n", hash);
+            }
         }
     }
-    free(peer);
 
-    leveldb_iter_destroy(iter);
-    leveldb_close(db);
+    for (i = 0; i < num_hashes; i++)
+    {
+        if (!answered[i]) printf("%s: no answer\n", hashes[i]);
+    }
+    if (num_hashes == 0 && remaining) printf("no answer\n");
 
+    free(answered);
     if (close(sockfd) == -1) exit(1);
 }
 
@@ -459,21 +2139,26 @@ void synchronize(void)
 {
     debug("Sync with network...\n");
 
-    int num_seeds;
-    num_seeds = 1;
+    const char *ips[SYNC_PEERS];
+    char *external_ip;
+    int i, num_ips;
+    int num_seeds = sizeof seeds / sizeof seeds[0];
 
-    int i;
+    external_ip = get_external_ip();
+    if (external_ip != NULL) external_ip[strcspn(external_ip, " \r\n")] = '\0';
+    srand(time(NULL) ^ getpid());
+
+    /* seeds join the peer table, and are picked by score like any peer */
+    peers_load();
     for (i = 0; i < num_seeds; i++)
     {
-        debug("Seed: %s\n", seeds[0]);
-        const char *external_ip;
-
-        external_ip = get_external_ip();
-        
-        if (strncmp(external_ip, seeds[0], strlen(seeds[0]))) {
-            share(seeds[0]);
-        }
+        debug("Seed: %s\n", seeds[i]);
+        peer_find(seeds[i], 1);
     }
+
+    /* pull a slice of the keyspace from each of the best peers at once */
+    num_ips = peers_pick(ips, SYNC_PEERS, external_ip);
+    if (num_ips > 0) share(ips, num_ips);
 }
 
 int main(int argc, char *argv[])
@@ -486,9 +2171,23 @@ int main(int argc, char *argv[])
             break;
         case 2:
             /* share links with a specific node (IP address) */
-            share(argv[1]);
+            share((const char **)&argv[1], 1);
             break;
         default: {
+            struct in_addr addr;
+
+            /* share links with several nodes, splitting the keyspace */
+            if (inet_pton(AF_INET, argv[2], &addr) > 0) {
+                share((const char **)&argv[1], argc - 1);
+                break;
+            }
+
+            /* query a node: q=lookup hashes, i=cache statistics */
+            if (argv[2][0] == 'q' || argv[2][0] == 'i') {
+                query(argv[1], &argv[3], (argv[2][0] == 'q') ? argc - 3 : 0);
+                break;
+            }
+
             /* manual database I/O */
             leveldb_t *db;
             leveldb_options_t *options;
@@ -539,7 +2238,7 @@ int main(int argc, char *argv[])
                     break;
                 }
                 default:
-                    die("Invalid action, only: g=get, s=set, d=delete");
+                    die("Invalid action, only: g=get, s=set, d=delete, q=query, i=info");
             }
             leveldb_close(db);
         }
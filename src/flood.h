@@ -47,9 +47,13 @@ extern "C" {
 #include <netdb.h>
 #include <ifaddrs.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <curl/curl.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -66,6 +70,52 @@ extern "C" {
 #define MAXTR 100
 #define PORT 9876
 #define DB "links"
+#define PEERS "peers"
+#define MAXPEERS 256
+#define SYNC_WAIT 3
+#define SYNC_TIMEOUT 60
+#define MAXRESUME 5
+#define MAXQUEUE 32
+#define QUEUE_NOTIFY 1
+#define MAXWIN 128
+#define WIN_INIT 4
+#define WIN_MIN 2
+#define DUPTHRESH 3
+#define MAXRETRY 8
+#define RTO_INIT 0.5
+#define RTO_MIN 0.02
+#define RTO_MAX 1.0
+#define RCVBUF (1 << 20)
+
+#ifndef CACHE_SIZE
+#define CACHE_SIZE 65536
+#endif
+
+/* links not seen for TTL seconds expire (0 keeps links forever), and are
+   purged from the database every PURGE_INTERVAL seconds */
+#ifndef TTL
+#define TTL (90 * 24 * 3600)
+#endif
+#ifndef PURGE_INTERVAL
+#define PURGE_INTERVAL 3600
+#endif
+#define PURGE_BATCH 1000
+#define PURGE_PAUSE 10000
+#define TOUCH_INTERVAL (TTL / 16)
+#define RECLEN (BUFLEN + 64)
+#define MERGE_STEPS 16
+#define MERGE_BATCH 256
+
+/* peers are synced with by score; measurements lose half their weight
+   every PEER_HALFLIFE seconds and peers unheard of for PEER_EXPIRE
+   seconds are forgotten.  Until a pull of at least PEER_MINLINKS links
+   measures it, a peer is assumed to take PEER_COST seconds per link. */
+#define SYNC_PEERS 4
+#define PEER_HALFLIFE (7 * 24 * 3600)
+#define PEER_EXPIRE (30 * 24 * 3600)
+#define PEER_SAVE 60
+#define PEER_MINLINKS 64
+#define PEER_COST 0.01
 
 #ifdef EPROTO
 #define RETRY 0